@@ -0,0 +1,496 @@
+// Throughput and latency sweep over threadsafe_queue, threadsafe_hashmap,
+// lockfree_multimap and thread_pool.
+//
+// Usage: ./benchmark [--threads=1,2,4] [--reads=0,50,90,100] [--dists=uniform,zipf]
+//                    [--sizes=8,64,256] [--only=queue,hashmap,multimap,pool]
+//                    [--ops=N] [--keys=N] [--format=csv|json] [--out=FILE] [--quick]
+//
+// Every configuration prints one record with the throughput over all threads
+// and the p50/p99/p999 latency of a single operation.
+#include "threadsafe_queue.hpp"
+#include "threadsafe_hashmap.hpp"
+#include "lockfree_multimap.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <array>
+#include <barrier>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using bench_clock = std::chrono::steady_clock;
+
+// Value type of the given size, so that copies cost what they would in real use
+template<std::size_t N>
+struct payload {
+    std::array<char, N> bytes{};
+
+    payload() = default;
+    explicit payload(std::uint64_t seed) {
+        bytes.fill(static_cast<char>(seed));
+    }
+};
+
+struct options {
+    std::vector<unsigned> threads;
+    std::vector<unsigned> read_pcts{0, 50, 90, 100};
+    std::vector<std::string> dists{"uniform", "zipf"};
+    std::vector<unsigned> sizes{8, 64, 256};
+    std::vector<std::string> only{"queue", "hashmap", "multimap", "pool"};
+    unsigned ops = 20'000;      // per thread
+    unsigned keys = 1024;
+    std::string format = "csv";
+    std::string out;
+};
+
+struct result {
+    std::string structure;
+    unsigned threads;
+    int read_pct;               // -1 where reads and writes don't apply
+    std::string dist;
+    unsigned value_size;
+    std::uint64_t ops;
+    double seconds;
+    double p50_ns;
+    double p99_ns;
+    double p999_ns;
+};
+
+/////////////// Key distributions /////////////////
+
+// Draws keys in [0, n) either uniformly or following a Zipf law with
+// exponent 0.99, by binary search over a precomputed CDF
+class key_generator {
+    std::vector<double> cdf;
+    std::uniform_real_distribution<double> unit{0.0, 1.0};
+    std::uniform_int_distribution<std::uint64_t> uniform;
+    std::mt19937_64 gen;
+    bool zipf;
+
+public:
+    key_generator(const std::string& dist, unsigned n, std::uint64_t seed)
+    : uniform(0, n - 1), gen(seed), zipf(dist == "zipf") {
+        if(!zipf)
+            return;
+        cdf.resize(n);
+        double sum = 0;
+        for(unsigned i=0; i<n; ++i) {
+            sum += 1.0 / std::pow(i + 1, 0.99);
+            cdf[i] = sum;
+        }
+        for(double& c: cdf)
+            c /= sum;
+    }
+
+    std::uint64_t next() {
+        if(!zipf)
+            return uniform(gen);
+        auto found = std::lower_bound(cdf.begin(), cdf.end(), unit(gen));
+        return std::min<std::uint64_t>(found - cdf.begin(), cdf.size() - 1);
+    }
+
+    bool chance(unsigned pct) {
+        return unit(gen) * 100 < pct;
+    }
+};
+
+/////////////// Measurement helpers /////////////////
+
+double percentile(const std::vector<std::uint64_t>& sorted, double p) {
+    if(sorted.empty())
+        return 0;
+    std::size_t idx = std::min<std::size_t>(sorted.size() - 1, p * sorted.size());
+    return sorted[idx];
+}
+
+// Runs body(thread_idx, latencies) on the given number of threads, all
+// starting together, and folds the per-operation latencies into a result
+template<typename Body>
+result run_threads(unsigned threads, Body body) {
+    std::vector<std::vector<std::uint64_t> > latencies(threads);
+    // Timed from inside the threads: the launching thread may not even get
+    // scheduled before they are done
+    std::vector<bench_clock::time_point> starts(threads), ends(threads);
+    std::barrier start_line(threads);
+    std::vector<std::thread> workers;
+    for(unsigned t=0; t<threads; ++t) {
+        workers.emplace_back([&, t] {
+            start_line.arrive_and_wait();
+            starts[t] = bench_clock::now();
+            body(t, latencies[t]);
+            ends[t] = bench_clock::now();
+        });
+    }
+    for(std::thread& thrd: workers)
+        thrd.join();
+    std::chrono::duration<double> elapsed =
+        *std::max_element(ends.begin(), ends.end()) - *std::min_element(starts.begin(), starts.end());
+
+    std::vector<std::uint64_t> all;
+    for(std::vector<std::uint64_t>& lat: latencies)
+        all.insert(all.end(), lat.begin(), lat.end());
+    std::sort(all.begin(), all.end());
+
+    result res{};
+    res.threads = threads;
+    res.ops = all.size();
+    res.seconds = elapsed.count();
+    res.p50_ns = percentile(all, 0.50);
+    res.p99_ns = percentile(all, 0.99);
+    res.p999_ns = percentile(all, 0.999);
+    return res;
+}
+
+// Times a single operation
+template<typename Op>
+void timed(std::vector<std::uint64_t>& latencies, Op op) {
+    auto start = bench_clock::now();
+    op();
+    auto end = bench_clock::now();
+    latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+}
+
+/////////////// Benchmarks /////////////////
+
+// Half of the threads push, the other half pop. A single thread alternates.
+template<std::size_t N>
+result bench_queue(const options& opts, unsigned threads) {
+    threadsafe_queue<payload<N> > q;
+    unsigned producers = std::max(1u, threads / 2);
+    unsigned consumers = threads - producers;
+    std::uint64_t total = std::uint64_t(opts.ops) * producers;
+
+    result res = run_threads(threads, [&](unsigned t, std::vector<std::uint64_t>& lat) {
+        lat.reserve(opts.ops * 2);
+        if(consumers == 0) {
+            payload<N> value;
+            for(unsigned i=0; i<opts.ops; ++i) {
+                timed(lat, [&] { q.push(payload<N>(i)); });
+                timed(lat, [&] { q.try_pop(value); });
+            }
+        }
+        else if(t < producers) {
+            for(unsigned i=0; i<opts.ops; ++i)
+                timed(lat, [&] { q.push(payload<N>(i)); });
+        }
+        else {
+            // Split the pops so that every pushed element gets consumed.
+            // Only successful pops count as operations.
+            unsigned c = t - producers;
+            std::uint64_t quota = total / consumers + (c < total % consumers ? 1 : 0);
+            payload<N> value;
+            for(std::uint64_t i=0; i<quota; ) {
+                auto start = bench_clock::now();
+                if(!q.try_pop(value))
+                    continue;
+                auto end = bench_clock::now();
+                lat.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+                ++i;
+            }
+        }
+    });
+    res.structure = "threadsafe_queue";
+    res.read_pct = -1;
+    res.dist = "-";
+    return res;
+}
+
+template<std::size_t N>
+result bench_hashmap(const options& opts, unsigned threads, unsigned read_pct, const std::string& dist) {
+    threadsafe_hashmap<std::uint64_t, payload<N> > hashmap(1009);
+    for(unsigned k=0; k<opts.keys; ++k)
+        hashmap.add_or_update(k, payload<N>(k));
+
+    result res = run_threads(threads, [&](unsigned t, std::vector<std::uint64_t>& lat) {
+        key_generator keys(dist, opts.keys, t + 1);
+        lat.reserve(opts.ops);
+        for(unsigned i=0; i<opts.ops; ++i) {
+            std::uint64_t k = keys.next();
+            if(keys.chance(read_pct))
+                timed(lat, [&] { hashmap.get_value(k); });
+            else
+                timed(lat, [&] { hashmap.add_or_update(k, payload<N>(i)); });
+        }
+    });
+    res.structure = "threadsafe_hashmap";
+    res.read_pct = read_pct;
+    res.dist = dist;
+    return res;
+}
+
+// Every write copies the whole map, so this one runs a tenth of the operations.
+// The map takes a single writer (see lockfree_multimap::update): thread 0
+// writes with the requested read percentage and the other threads only look
+// up, so rows report the read percentage actually run over all threads.
+template<std::size_t N>
+result bench_multimap(const options& opts, unsigned threads, unsigned read_pct, const std::string& dist) {
+    using multimap_type = lockfree_multimap<std::uint64_t, payload<N> >;
+    multimap_type multimap;
+    // One retired list per thread, freed once every thread is done with the maps
+    std::vector<typename multimap_type::garbage_collector> gcs(threads + 1);
+    for(unsigned k=0; k<opts.keys; ++k)
+        multimap.update(k, payload<N>(k), gcs[threads]);
+    unsigned ops = std::max(1u, opts.ops / 10);
+    std::vector<std::uint64_t> lookups(threads);
+
+    result res = run_threads(threads, [&](unsigned t, std::vector<std::uint64_t>& lat) {
+        key_generator keys(dist, opts.keys, t + 1);
+        payload<N> not_found;
+        std::uint64_t n_lookups = 0;
+        lat.reserve(ops);
+        for(unsigned i=0; i<ops; ++i) {
+            std::uint64_t k = keys.next();
+            if(t != 0 || keys.chance(read_pct)) {
+                timed(lat, [&] { multimap.lookup(k, not_found); });
+                ++n_lookups;
+            }
+            // Alternate erase and update so the map keeps its size
+            else if(i % 2)
+                timed(lat, [&] { multimap.erase(k, gcs[t]); });
+            else
+                timed(lat, [&] { multimap.update(k, payload<N>(i), gcs[t]); });
+        }
+        lookups[t] = n_lookups;
+    });
+    for(typename multimap_type::garbage_collector& gc: gcs)
+        multimap.reclaim_all(gc);
+
+    res.structure = "lockfree_multimap";
+    std::uint64_t total_lookups = 0;
+    for(std::uint64_t n: lookups)
+        total_lookups += n;
+    res.read_pct = static_cast<int>(std::lround(100.0 * total_lookups / res.ops));
+    res.dist = dist;
+    return res;
+}
+
+// The pool runs as many workers as there are submitting threads. Latency is
+// the time a task spends between post() and the start of its execution.
+template<std::size_t N>
+result bench_pool(const options& opts, unsigned threads) {
+    thread_pool pool(threads);
+
+    result res = run_threads(threads, [&](unsigned, std::vector<std::uint64_t>& lat) {
+        lat.resize(opts.ops);
+        std::atomic<unsigned> finished(0);
+        for(unsigned i=0; i<opts.ops; ++i) {
+            pool.post([&lat, &finished, i, value = payload<N>(i), posted = bench_clock::now()] {
+                auto started = bench_clock::now();
+                (void)value;
+                lat[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(started - posted).count();
+                finished.fetch_add(1, std::memory_order_release);
+            });
+        }
+        while(finished.load(std::memory_order_acquire) != opts.ops)
+            std::this_thread::yield();
+    });
+    res.structure = "thread_pool";
+    res.read_pct = -1;
+    res.dist = "-";
+    return res;
+}
+
+/////////////// Driver /////////////////
+
+template<std::size_t N>
+void run_size(const options& opts, std::vector<result>& results) {
+    auto wanted = [&](const std::string& name) {
+        return std::find(opts.only.begin(), opts.only.end(), name) != opts.only.end();
+    };
+    auto record = [&](result res) {
+        res.value_size = N;
+        std::cerr << res.structure << " threads=" << res.threads << " reads=" << res.read_pct
+                  << " dist=" << res.dist << " size=" << N << '\n';
+        results.push_back(std::move(res));
+    };
+
+    for(unsigned threads: opts.threads) {
+        if(wanted("queue"))
+            record(bench_queue<N>(opts, threads));
+        if(wanted("pool"))
+            record(bench_pool<N>(opts, threads));
+        for(unsigned read_pct: opts.read_pcts) {
+            for(const std::string& dist: opts.dists) {
+                if(wanted("hashmap"))
+                    record(bench_hashmap<N>(opts, threads, read_pct, dist));
+                if(wanted("multimap"))
+                    record(bench_multimap<N>(opts, threads, read_pct, dist));
+            }
+        }
+    }
+}
+
+void write_csv(std::ostream& out, const std::vector<result>& results) {
+    out << "structure,threads,read_pct,distribution,value_size,ops,seconds,ops_per_sec,p50_ns,p99_ns,p999_ns\n";
+    for(const result& r: results) {
+        out << r.structure << ',' << r.threads << ',' << r.read_pct << ',' << r.dist << ','
+            << r.value_size << ',' << r.ops << ',' << r.seconds << ',' << r.ops / r.seconds << ','
+            << r.p50_ns << ',' << r.p99_ns << ',' << r.p999_ns << '\n';
+    }
+}
+
+void write_json(std::ostream& out, const std::vector<result>& results) {
+    out << "[\n";
+    for(std::size_t i=0; i<results.size(); ++i) {
+        const result& r = results[i];
+        out << "  {\"structure\": \"" << r.structure << "\", \"threads\": " << r.threads
+            << ", \"read_pct\": " << r.read_pct << ", \"distribution\": \"" << r.dist
+            << "\", \"value_size\": " << r.value_size << ", \"ops\": " << r.ops
+            << ", \"seconds\": " << r.seconds << ", \"ops_per_sec\": " << r.ops / r.seconds
+            << ", \"p50_ns\": " << r.p50_ns << ", \"p99_ns\": " << r.p99_ns
+            << ", \"p999_ns\": " << r.p999_ns << '}' << (i + 1 < results.size() ? "," : "") << '\n';
+    }
+    out << "]\n";
+}
+
+// Throws std::invalid_argument on an empty list or an item that doesn't parse
+template<typename T>
+std::vector<T> parse_list(const std::string& list) {
+    std::vector<T> res;
+    std::stringstream ss(list);
+    std::string item;
+    while(std::getline(ss, item, ',')) {
+        std::stringstream conv(item);
+        T value;
+        // Unsigned extraction accepts "-1" and wraps it, reject the sign up front
+        if(item.find('-') != std::string::npos || !(conv >> value) || !(conv >> std::ws).eof())
+            throw std::invalid_argument("bad list item '" + item + "'");
+        res.push_back(value);
+    }
+    if(res.empty())
+        throw std::invalid_argument("empty list");
+    return res;
+}
+
+unsigned parse_count(const std::string& value) {
+    std::vector<unsigned> res = parse_list<unsigned>(value);
+    if(res.size() != 1)
+        throw std::invalid_argument("expected a single number, got '" + value + "'");
+    return res[0];
+}
+
+int main(int argc, char* argv[]) {
+    options opts;
+    for(unsigned t=1; t<std::max(1u, std::thread::hardware_concurrency()); t*=2)
+        opts.threads.push_back(t);
+    opts.threads.push_back(std::max(1u, std::thread::hardware_concurrency()));
+
+    // --quick only sets defaults, the options given with it take precedence
+    for(int i=1; i<argc; ++i) {
+        if(std::string(argv[i]) == "--quick") {
+            opts.threads = {1, 2};
+            opts.read_pcts = {90};
+            opts.sizes = {8};
+            opts.ops = 2000;
+        }
+    }
+
+    for(int i=1; i<argc; ++i) {
+        std::string arg = argv[i];
+        std::size_t eq = arg.find('=');
+        std::string name = arg.substr(0, eq);
+        std::string value = (eq == std::string::npos) ? "" : arg.substr(eq + 1);
+        try {
+            if(name == "--threads")
+                opts.threads = parse_list<unsigned>(value);
+            else if(name == "--reads")
+                opts.read_pcts = parse_list<unsigned>(value);
+            else if(name == "--dists")
+                opts.dists = parse_list<std::string>(value);
+            else if(name == "--sizes")
+                opts.sizes = parse_list<unsigned>(value);
+            else if(name == "--only")
+                opts.only = parse_list<std::string>(value);
+            else if(name == "--ops")
+                opts.ops = parse_count(value);
+            else if(name == "--keys")
+                opts.keys = parse_count(value);
+            else if(name == "--format")
+                opts.format = value;
+            else if(name == "--out")
+                opts.out = value;
+            else if(name != "--quick") {
+                std::cerr << "unknown option " << arg << '\n';
+                return 1;
+            }
+        }
+        catch(const std::invalid_argument& e) {
+            std::cerr << arg << ": " << e.what() << '\n';
+            return 1;
+        }
+    }
+
+    if(std::find(opts.threads.begin(), opts.threads.end(), 0u) != opts.threads.end()) {
+        std::cerr << "thread counts must be at least 1\n";
+        return 1;
+    }
+    if(std::find_if(opts.read_pcts.begin(), opts.read_pcts.end(), [](unsigned p) { return p > 100; }) != opts.read_pcts.end()) {
+        std::cerr << "read percentages must be between 0 and 100\n";
+        return 1;
+    }
+    for(const std::string& dist: opts.dists) {
+        if(dist != "uniform" && dist != "zipf") {
+            std::cerr << "unknown distribution " << dist << " (uniform or zipf)\n";
+            return 1;
+        }
+    }
+    for(const std::string& name: opts.only) {
+        if(name != "queue" && name != "hashmap" && name != "multimap" && name != "pool") {
+            std::cerr << "unknown structure " << name << " (queue, hashmap, multimap or pool)\n";
+            return 1;
+        }
+    }
+    if(opts.format != "csv" && opts.format != "json") {
+        std::cerr << "unknown format " << opts.format << " (csv or json)\n";
+        return 1;
+    }
+    if(opts.ops == 0 || opts.keys == 0) {
+        std::cerr << "--ops and --keys must be at least 1\n";
+        return 1;
+    }
+
+    // Opened before the runs so that a bad path doesn't waste them
+    std::ofstream file;
+    if(!opts.out.empty()) {
+        file.open(opts.out);
+        if(!file) {
+            std::cerr << "cannot open " << opts.out << " for writing\n";
+            return 1;
+        }
+    }
+
+    std::vector<result> results;
+    for(unsigned size: opts.sizes) {
+        switch(size) {
+        case 8: run_size<8>(opts, results); break;
+        case 64: run_size<64>(opts, results); break;
+        case 256: run_size<256>(opts, results); break;
+        case 1024: run_size<1024>(opts, results); break;
+        default:
+            std::cerr << "unsupported value size " << size << " (8, 64, 256 or 1024)\n";
+            return 1;
+        }
+    }
+
+    std::ostream& out = opts.out.empty() ? std::cout : file;
+    if(opts.format == "json")
+        write_json(out, results);
+    else
+        write_csv(out, results);
+
+    out.flush();
+    if(!out) {
+        std::cerr << "failed to write " << (opts.out.empty() ? "results" : opts.out) << '\n';
+        return 1;
+    }
+    return 0;
+}
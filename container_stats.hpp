@@ -0,0 +1,218 @@
+#pragma once
+
+// Optional contention and latency instrumentation shared by the containers.
+//
+// Build with -DCONCURRENCY_STATS=1 to turn it on. Otherwise every recorder
+// below is an empty type whose methods do nothing, and the containers hold
+// them as [[no_unique_address]] members, so they cost neither space nor time.
+// The setting changes class layouts: all translation units of a program must
+// agree on it.
+//
+// The *_snapshot types are always available. With stats disabled they come
+// back zeroed, apart from what the containers can report on demand anyway
+// (sizes, bucket lengths).
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+
+#ifndef CONCURRENCY_STATS
+#define CONCURRENCY_STATS 0
+#endif
+
+constexpr bool stats_enabled = CONCURRENCY_STATS;
+
+struct lock_stats_snapshot {
+    std::uint64_t acquisitions = 0;
+    std::uint64_t contended = 0;    // acquisitions that had to wait
+    std::uint64_t wait_ns = 0;      // total time spent waiting on those
+};
+
+struct queue_stats_snapshot {
+    lock_stats_snapshot lock;
+    std::uint64_t depth = 0;
+    std::uint64_t depth_high_water = 0;
+};
+
+// Log2 histogram: bins[i] counts samples in [2^(i-1), 2^i) ns, bins[0] the zeros
+struct latency_snapshot {
+    static constexpr unsigned NUM_BINS = 64;
+
+    std::uint64_t count = 0;
+    std::uint64_t total_ns = 0;
+    std::uint64_t max_ns = 0;
+    std::vector<std::uint64_t> bins;
+
+    // Upper bound of the bin holding the p-th quantile
+    std::uint64_t percentile_ns(double p) const {
+        if(count == 0)
+            return 0;
+        std::uint64_t rank = static_cast<std::uint64_t>(p * count);
+        std::uint64_t seen = 0;
+        for(unsigned i=0; i<bins.size(); ++i) {
+            seen += bins[i];
+            if(seen > rank)
+                return (i == 0) ? 0 : std::min<std::uint64_t>(max_ns, (std::uint64_t(1) << i) - 1);
+        }
+        return max_ns;
+    }
+
+    double mean_ns() const {
+        return count ? double(total_ns) / count : 0.0;
+    }
+};
+
+#if CONCURRENCY_STATS
+
+class stats_timestamp {
+    std::chrono::steady_clock::time_point t;
+
+public:
+    static stats_timestamp now() noexcept {
+        stats_timestamp ts;
+        ts.t = std::chrono::steady_clock::now();
+        return ts;
+    }
+
+    std::uint64_t ns_until(const stats_timestamp& later) const noexcept {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(later.t - t).count();
+    }
+};
+
+// N counters indexed by a container's own enum. A single member holds all
+// of them: several empty members of the same type could not share an address.
+template<std::size_t N>
+class event_counters {
+    std::atomic<std::uint64_t> values[N] = {};
+
+public:
+    void add(std::size_t idx, std::uint64_t n = 1) noexcept {
+        values[idx].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    std::uint64_t load(std::size_t idx) const noexcept {
+        return values[idx].load(std::memory_order_relaxed);
+    }
+};
+
+class high_water_mark {
+    std::atomic<std::uint64_t> value{0};
+
+public:
+    void update(std::uint64_t v) noexcept {
+        std::uint64_t cur = value.load(std::memory_order_relaxed);
+        while(v > cur && !value.compare_exchange_weak(cur, v, std::memory_order_relaxed))
+            ;
+    }
+
+    std::uint64_t load() const noexcept {
+        return value.load(std::memory_order_relaxed);
+    }
+};
+
+// Counts acquisitions of one lock, and times those that don't succeed right away
+class lock_stats {
+    std::atomic<std::uint64_t> acquisitions{0};
+    std::atomic<std::uint64_t> contended{0};
+    std::atomic<std::uint64_t> wait_ns{0};
+
+public:
+    // lk is a deferred std::unique_lock or std::shared_lock
+    template<typename Lock>
+    void lock(Lock& lk) {
+        if(!lk.try_lock()) {
+            stats_timestamp start = stats_timestamp::now();
+            lk.lock();
+            contended.fetch_add(1, std::memory_order_relaxed);
+            wait_ns.fetch_add(start.ns_until(stats_timestamp::now()), std::memory_order_relaxed);
+        }
+        acquisitions.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    lock_stats_snapshot snapshot() const noexcept {
+        lock_stats_snapshot res;
+        res.acquisitions = acquisitions.load(std::memory_order_relaxed);
+        res.contended = contended.load(std::memory_order_relaxed);
+        res.wait_ns = wait_ns.load(std::memory_order_relaxed);
+        return res;
+    }
+};
+
+// N latency histograms indexed by a container's own enum, see event_counters
+template<std::size_t N>
+class latency_histograms {
+    struct histogram {
+        std::atomic<std::uint64_t> bins[latency_snapshot::NUM_BINS] = {};
+        std::atomic<std::uint64_t> total_ns{0};
+        high_water_mark max_ns;
+    };
+    histogram hists[N];
+
+public:
+    void record(std::size_t idx, const stats_timestamp& from, const stats_timestamp& to) noexcept {
+        std::uint64_t ns = from.ns_until(to);
+        unsigned bin = 0;
+        for(std::uint64_t v=ns; v && bin<latency_snapshot::NUM_BINS-1; v>>=1)
+            ++bin;
+        histogram& h = hists[idx];
+        h.bins[bin].fetch_add(1, std::memory_order_relaxed);
+        h.total_ns.fetch_add(ns, std::memory_order_relaxed);
+        h.max_ns.update(ns);
+    }
+
+    latency_snapshot snapshot(std::size_t idx) const {
+        const histogram& h = hists[idx];
+        latency_snapshot res;
+        res.bins.resize(latency_snapshot::NUM_BINS);
+        for(unsigned i=0; i<latency_snapshot::NUM_BINS; ++i) {
+            res.bins[i] = h.bins[i].load(std::memory_order_relaxed);
+            res.count += res.bins[i];
+        }
+        res.total_ns = h.total_ns.load(std::memory_order_relaxed);
+        res.max_ns = h.max_ns.load();
+        return res;
+    }
+};
+
+#else
+
+struct stats_timestamp {
+    static stats_timestamp now() noexcept {
+        return {};
+    }
+};
+
+template<std::size_t N>
+struct event_counters {
+    void add(std::size_t, std::uint64_t = 1) noexcept {}
+    std::uint64_t load(std::size_t) const noexcept { return 0; }
+};
+
+struct high_water_mark {
+    void update(std::uint64_t) noexcept {}
+    std::uint64_t load() const noexcept { return 0; }
+};
+
+struct lock_stats {
+    template<typename Lock>
+    void lock(Lock& lk) {
+        lk.lock();
+    }
+
+    lock_stats_snapshot snapshot() const noexcept {
+        return {};
+    }
+};
+
+template<std::size_t N>
+struct latency_histograms {
+    void record(std::size_t, const stats_timestamp&, const stats_timestamp&) noexcept {}
+
+    latency_snapshot snapshot(std::size_t) const {
+        return {};
+    }
+};
+
+#endif
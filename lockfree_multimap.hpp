@@ -1,3 +1,4 @@
+#include "container_stats.hpp"
 #include <functional>
 #include <unordered_map>
 #include <memory>
@@ -6,6 +7,21 @@
 #include <algorithm>
 #include <vector>
 
+struct multimap_stats_snapshot {
+    // Failed compare-exchanges of the map pointer
+    std::uint64_t update_cas_retries = 0;
+    std::uint64_t erase_cas_retries = 0;
+    // Old maps put on a garbage_collector, and how many of them scan() or
+    // reclaim_all() deleted. Maps the caller deletes itself stay in the backlog.
+    std::uint64_t retired = 0;
+    std::uint64_t reclaimed = 0;
+    std::uint64_t retired_backlog = 0;
+    // Longest garbage_collector seen by retire()
+    std::uint64_t retired_list_high_water = 0;
+    // Hazard pointer records ever allocated, reported even without CONCURRENCY_STATS
+    std::uint64_t hazard_pointers = 0;
+};
+
 template<class key, class value, class hash_fct = std::hash<key> >
 class lockfree_multimap
 {
@@ -113,11 +129,19 @@ public:
         delete map_ptr;
     }
 
+    // update() and erase() copy the current map without a hazard pointer on
+    // it. With more than one writer, another writer's scan() can delete that
+    // map in the middle of the copy: call them from a single thread at a time.
+    // lookup() is safe from any number of threads alongside that writer.
     void update(const key& k, const value& v, garbage_collector& gc)
     {
         map_type *p_new = nullptr;
         map_type *p_old;
+        bool first_try = true;
         do {
+            if(!first_try)
+                counters_.add(UPDATE_CAS_RETRIES);
+            first_try = false;
             p_old = s_map_.load();
             delete p_new;
 
@@ -141,7 +165,11 @@ public:
         map_type *p_new = nullptr;
         map_type *p_old;
         size_t result;
+        bool first_try = true;
         do {
+            if(!first_try)
+                counters_.add(ERASE_CAS_RETRIES);
+            first_try = false;
             p_old = s_map_.load();
             delete p_new;
 
@@ -190,13 +218,41 @@ public:
         return result;
     }
 
+    // Deletes every map left on gc. Only safe once no thread can be in
+    // lookup() any more, e.g. after joining the readers.
+    void reclaim_all(garbage_collector& gc)
+    {
+        for(map_type *map_ptr: gc) {
+            delete map_ptr;
+            counters_.add(RECLAIMED);
+        }
+        gc.clear();
+    }
+
+    // CAS retries and reclamation backlog, zeroed unless CONCURRENCY_STATS is set
+    multimap_stats_snapshot stats() const
+    {
+        multimap_stats_snapshot res;
+        res.update_cas_retries = counters_.load(UPDATE_CAS_RETRIES);
+        res.erase_cas_retries = counters_.load(ERASE_CAS_RETRIES);
+        res.retired = counters_.load(RETIRED);
+        res.reclaimed = counters_.load(RECLAIMED);
+        res.retired_backlog = res.retired - res.reclaimed;
+        res.retired_list_high_water = retired_list_hw_.load();
+        res.hazard_pointers = hp_list_.ListLen();
+        return res;
+    }
+
 private:
 
     void retire(garbage_collector& gc, map_type * pOld)
     {
         // put it in the retired list
-        if(pOld)
+        if(pOld) {
             gc.push_back(pOld);
+            counters_.add(RETIRED);
+            retired_list_hw_.update(gc.size());
+        }
 
         // clean up the gc from time to time
         if (gc.size() >= 1.25 * hp_list_.ListLen()) 
@@ -225,6 +281,7 @@ private:
             if ( !std::binary_search(hp.begin(), hp.end(), *i) ) {
                 // Aha!
                 delete *i;
+                counters_.add(RECLAIMED);
 
 				typename garbage_collector::iterator itmp = i;
 				itmp++;
@@ -239,4 +296,8 @@ private:
     std::atomic<map_type *> s_map_;  // pointer to the map
 
     mutable HPList hp_list_;
+
+    enum { UPDATE_CAS_RETRIES, ERASE_CAS_RETRIES, RETIRED, RECLAIMED, NUM_COUNTERS };
+    [[no_unique_address]] event_counters<NUM_COUNTERS> counters_;
+    [[no_unique_address]] high_water_mark retired_list_hw_;
 };
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <thread>
+#if defined(__linux__)
+#include <sched.h>
+#include <pthread.h>
+#endif
+
+// NUMA nodes and their CPUs, as discovered from /sys/devices/system/node.
+// Only CPUs the process is allowed to run on are kept, and nodes left without
+// CPUs are dropped. Machines without sysfs NUMA info end up with one node.
+class numa_topology
+{
+public:
+    struct node {
+        unsigned id;                    // node id as named by the kernel
+        std::vector<unsigned> cpus;
+        std::vector<unsigned> distance; // distance to every other node, by index
+    };
+
+private:
+    std::vector<node> _nodes;
+
+    // Parses a kernel cpu/node list such as "0-3,8,10-11"
+    static std::vector<unsigned> parse_list(const std::string& list) {
+        std::vector<unsigned> res;
+        std::stringstream ss(list);
+        std::string range;
+        while(std::getline(ss, range, ',')) {
+            if(range.empty() || range == "\n")
+                continue;
+            try {
+                std::size_t dash = range.find('-');
+                unsigned first = std::stoul(range.substr(0, dash));
+                unsigned last = (dash == std::string::npos) ? first : std::stoul(range.substr(dash+1));
+                for(unsigned i=first; i<=last; ++i)
+                    res.push_back(i);
+            }
+            catch(const std::exception&) {
+                return {};
+            }
+        }
+        return res;
+    }
+
+    static std::string read_line(const std::string& path) {
+        std::ifstream in(path);
+        std::string line;
+        std::getline(in, line);
+        return line;
+    }
+
+    static std::vector<unsigned> allowed_cpus() {
+        std::vector<unsigned> res;
+#if defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if(sched_getaffinity(0, sizeof(set), &set) == 0) {
+            for(unsigned i=0; i<CPU_SETSIZE; ++i)
+                if(CPU_ISSET(i, &set))
+                    res.push_back(i);
+        }
+#endif
+        if(res.empty()) {
+            unsigned n = std::max(1u, std::thread::hardware_concurrency());
+            for(unsigned i=0; i<n; ++i)
+                res.push_back(i);
+        }
+        return res;
+    }
+
+public:
+    explicit numa_topology(const std::string& sysfs_root = "/sys/devices/system/node")
+    : numa_topology(sysfs_root, allowed_cpus()) {
+    }
+
+    // allowed must be sorted
+    numa_topology(const std::string& sysfs_root, const std::vector<unsigned>& allowed) {
+        std::vector<unsigned> node_ids = parse_list(read_line(sysfs_root + "/online"));
+        std::vector<std::vector<unsigned> > raw_distance;
+
+        for(unsigned id: node_ids) {
+            std::string dir = sysfs_root + "/node" + std::to_string(id);
+            node n{id, {}, {}};
+            for(unsigned cpu: parse_list(read_line(dir + "/cpulist")))
+                if(std::binary_search(allowed.begin(), allowed.end(), cpu))
+                    n.cpus.push_back(cpu);
+
+            // distance is listed for every online node, in node_ids order
+            std::vector<unsigned> dist;
+            std::stringstream ss(read_line(dir + "/distance"));
+            unsigned d;
+            while(ss >> d)
+                dist.push_back(d);
+            if(dist.size() != node_ids.size())
+                dist.clear();
+
+            _nodes.push_back(std::move(n));
+            raw_distance.push_back(std::move(dist));
+        }
+
+        // Drop nodes we cannot run on, keeping distances in step
+        std::vector<std::size_t> kept;
+        for(std::size_t i=0; i<_nodes.size(); ++i)
+            if(!_nodes[i].cpus.empty())
+                kept.push_back(i);
+        std::vector<node> nodes;
+        for(std::size_t i: kept) {
+            node n = std::move(_nodes[i]);
+            for(std::size_t j: kept)
+                n.distance.push_back(raw_distance[i].empty() ? (i == j ? 10 : 20) : raw_distance[i][j]);
+            nodes.push_back(std::move(n));
+        }
+        _nodes = std::move(nodes);
+
+        // Single-node fallback
+        if(_nodes.empty())
+            _nodes.push_back(node{0, allowed, {10}});
+    }
+
+    const std::vector<node>& nodes() const noexcept {
+        return _nodes;
+    }
+
+    unsigned num_nodes() const noexcept {
+        return _nodes.size();
+    }
+
+    unsigned num_cpus() const noexcept {
+        unsigned n = 0;
+        for(const node& nd: _nodes)
+            n += nd.cpus.size();
+        return n;
+    }
+
+    // Indices of all nodes ordered by distance from node idx, nearest (idx itself) first
+    std::vector<unsigned> nodes_by_distance(unsigned idx) const {
+        std::vector<unsigned> order(_nodes.size());
+        for(unsigned i=0; i<order.size(); ++i)
+            order[i] = i;
+        std::stable_sort(order.begin(), order.end(), [&](unsigned a, unsigned b) {
+            if(a == idx || b == idx)
+                return a == idx && b != idx;
+            return _nodes[idx].distance[a] < _nodes[idx].distance[b];
+        });
+        return order;
+    }
+
+    // Restricts the calling thread to the given CPUs. Returns false if the
+    // platform doesn't support it or the kernel refused.
+    static bool pin_current_thread(const std::vector<unsigned>& cpus) {
+#if defined(__linux__)
+        if(cpus.empty())
+            return false;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for(unsigned cpu: cpus)
+            if(cpu < CPU_SETSIZE)
+                CPU_SET(cpu, &set);
+        return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+        (void)cpus;
+        return false;
+#endif
+    }
+};
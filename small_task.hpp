@@ -0,0 +1,258 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <mutex>
+#include <memory>
+#include <utility>
+#include <type_traits>
+
+// Fixed-size block cache backing the allocations made for every task: future
+// shared states and callables too big for small_task's inline buffer.
+// Each thread keeps a bounded free list per size class and trades batches of
+// blocks with a mutex-protected central list when it runs dry or overflows.
+class block_pool
+{
+    static constexpr std::size_t GRANULE = 64;
+    static constexpr std::size_t NUM_CLASSES = 8;   // blocks up to 512 bytes
+    static constexpr std::size_t BATCH = 32;
+    static constexpr std::size_t LOCAL_MAX = 2 * BATCH;
+
+    struct free_block {
+        free_block* next;
+    };
+
+    struct central_list {
+        std::mutex mut;
+        free_block* head = nullptr;
+    };
+
+    struct local_cache {
+        free_block* head[NUM_CLASSES] = {};
+        std::size_t count[NUM_CLASSES] = {};
+
+        ~local_cache() {
+            // Hand everything back so other threads can reuse it
+            for(std::size_t cls=0; cls<NUM_CLASSES; ++cls)
+                give_back(*this, cls, count[cls]);
+        }
+    };
+
+    // Never destroyed: workers of a thread_pool with static storage exit
+    // during static destruction, and their local caches still give back here
+    static central_list& central(std::size_t cls) {
+        static central_list* lists = new central_list[NUM_CLASSES];
+        return lists[cls];
+    }
+
+    static local_cache& cache() {
+        static thread_local local_cache c;
+        return c;
+    }
+
+    static std::size_t size_class(std::size_t bytes) noexcept {
+        return (bytes + GRANULE - 1) / GRANULE - 1;
+    }
+
+    // Moves n blocks from the local cache to the central list
+    static void give_back(local_cache& c, std::size_t cls, std::size_t n) {
+        if(n == 0)
+            return;
+        free_block* first = c.head[cls];
+        free_block* last = first;
+        for(std::size_t i=1; i<n; ++i)
+            last = last->next;
+        c.head[cls] = last->next;
+        c.count[cls] -= n;
+
+        central_list& cl = central(cls);
+        std::lock_guard<std::mutex> lk(cl.mut);
+        last->next = cl.head;
+        cl.head = first;
+    }
+
+    // Moves up to BATCH blocks from the central list to the local cache
+    static void refill(local_cache& c, std::size_t cls) {
+        central_list& cl = central(cls);
+        std::lock_guard<std::mutex> lk(cl.mut);
+        for(std::size_t i=0; i<BATCH && cl.head; ++i) {
+            free_block* b = cl.head;
+            cl.head = b->next;
+            b->next = c.head[cls];
+            c.head[cls] = b;
+            ++c.count[cls];
+        }
+    }
+
+public:
+    static void* allocate(std::size_t bytes) {
+        if(bytes == 0 || bytes > GRANULE * NUM_CLASSES)
+            return ::operator new(bytes);
+
+        std::size_t cls = size_class(bytes);
+        local_cache& c = cache();
+        if(!c.head[cls])
+            refill(c, cls);
+        if(!c.head[cls])
+            return ::operator new((cls + 1) * GRANULE);
+
+        free_block* b = c.head[cls];
+        c.head[cls] = b->next;
+        --c.count[cls];
+        return b;
+    }
+
+    static void deallocate(void* p, std::size_t bytes) noexcept {
+        if(bytes == 0 || bytes > GRANULE * NUM_CLASSES) {
+            ::operator delete(p);
+            return;
+        }
+
+        std::size_t cls = size_class(bytes);
+        local_cache& c = cache();
+        free_block* b = static_cast<free_block*>(p);
+        b->next = c.head[cls];
+        c.head[cls] = b;
+        // Blocks freed by another thread than the one that allocated them
+        // pile up here, send the surplus back
+        if(++c.count[cls] > LOCAL_MAX)
+            give_back(c, cls, BATCH);
+    }
+};
+
+// Standard allocator on top of block_pool, used for std::promise shared states
+template<typename T>
+struct block_allocator
+{
+    using value_type = T;
+
+    block_allocator() noexcept = default;
+    template<typename U>
+    block_allocator(const block_allocator<U>&) noexcept {}
+
+    T* allocate(std::size_t n) {
+        static_assert(alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__, "over-aligned type");
+        return static_cast<T*>(block_pool::allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, std::size_t n) noexcept {
+        block_pool::deallocate(p, n * sizeof(T));
+    }
+
+    template<typename U>
+    bool operator==(const block_allocator<U>&) const noexcept { return true; }
+    template<typename U>
+    bool operator!=(const block_allocator<U>&) const noexcept { return false; }
+};
+
+// Move-only void() callable, stored inline when it fits in INLINE_SIZE bytes
+// and in a block_pool block otherwise. sizeof(small_task) is one cache line.
+class small_task
+{
+public:
+    static constexpr std::size_t INLINE_SIZE = 56;
+
+private:
+    struct vtable {
+        void (*invoke)(void* storage);
+        // Move-constructs into dst and destroys src
+        void (*relocate)(void* dst, void* src) noexcept;
+        void (*destroy)(void* storage) noexcept;
+    };
+
+    template<typename F>
+    static constexpr bool fits_inline = sizeof(F) <= INLINE_SIZE
+        && alignof(F) <= alignof(std::max_align_t)
+        && std::is_nothrow_move_constructible_v<F>;
+
+    template<typename F>
+    static constexpr vtable inline_vtable = {
+        [](void* s) { (*std::launder(static_cast<F*>(s)))(); },
+        [](void* dst, void* src) noexcept {
+            F* f = std::launder(static_cast<F*>(src));
+            ::new(dst) F(std::move(*f));
+            f->~F();
+        },
+        [](void* s) noexcept { std::launder(static_cast<F*>(s))->~F(); }
+    };
+
+    // Heap case: the inline buffer just holds the F*
+    template<typename F>
+    static constexpr vtable heap_vtable = {
+        [](void* s) { (**static_cast<F**>(s))(); },
+        [](void* dst, void* src) noexcept { *static_cast<F**>(dst) = *static_cast<F**>(src); },
+        [](void* s) noexcept {
+            F* f = *static_cast<F**>(s);
+            f->~F();
+            block_pool::deallocate(f, sizeof(F));
+        }
+    };
+
+    alignas(std::max_align_t) unsigned char storage[INLINE_SIZE];
+    const vtable* vt = nullptr;
+
+    void reset() noexcept {
+        if(vt) {
+            vt->destroy(storage);
+            vt = nullptr;
+        }
+    }
+
+public:
+    small_task() noexcept {}
+
+    template<typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, small_task> > >
+    small_task(F&& f) {
+        using func_type = std::decay_t<F>;
+        if constexpr(fits_inline<func_type>) {
+            ::new(static_cast<void*>(storage)) func_type(std::forward<F>(f));
+            vt = &inline_vtable<func_type>;
+        }
+        else {
+            static_assert(alignof(func_type) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__, "over-aligned callable");
+            void* mem = block_pool::allocate(sizeof(func_type));
+            try {
+                *reinterpret_cast<func_type**>(storage) = ::new(mem) func_type(std::forward<F>(f));
+            }
+            catch(...) {
+                block_pool::deallocate(mem, sizeof(func_type));
+                throw;
+            }
+            vt = &heap_vtable<func_type>;
+        }
+    }
+
+    small_task(small_task&& other) noexcept : vt(other.vt) {
+        if(vt) {
+            vt->relocate(storage, other.storage);
+            other.vt = nullptr;
+        }
+    }
+
+    small_task& operator=(small_task&& other) noexcept {
+        if(this != &other) {
+            reset();
+            if(other.vt) {
+                other.vt->relocate(storage, other.storage);
+                vt = other.vt;
+                other.vt = nullptr;
+            }
+        }
+        return *this;
+    }
+
+    small_task(const small_task& other) = delete;
+    small_task& operator=(const small_task& rhs) = delete;
+
+    ~small_task() {
+        reset();
+    }
+
+    explicit operator bool() const noexcept {
+        return vt != nullptr;
+    }
+
+    void operator()() {
+        vt->invoke(storage);
+    }
+};
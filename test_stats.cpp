@@ -0,0 +1,136 @@
+#define CONCURRENCY_STATS 1
+
+#include "threadsafe_queue.hpp"
+#include "threadsafe_hashmap.hpp"
+#include "lockfree_multimap.hpp"
+#include "thread_pool.hpp"
+
+#include <cassert>
+#include <string>
+#include <future>
+#include <thread>
+#include <iostream>
+
+int main() {
+    static_assert(stats_enabled);
+
+    /////////////// threadsafe_queue /////////////////
+    std::cout << "threadsafe_queue stats test" << std::endl;
+    {
+        threadsafe_queue<int> q;
+        for(int i=0; i<10; ++i)
+            q.push(int(i));
+        int value;
+        for(int i=0; i<4; ++i)
+            assert(q.try_pop(value));
+        queue_stats_snapshot st = q.stats();
+        assert(st.depth == 6);
+        assert(st.depth_high_water == 10);
+        // 10 pushes and 4 pops; empty(), size() and stats() itself don't count
+        assert(!q.empty());
+        assert(q.size() == 6);
+        st = q.stats();
+        assert(st.lock.acquisitions == 14);
+        assert(st.lock.contended <= st.lock.acquisitions);
+
+        // Hammer it from a few threads so that some acquisitions have to wait
+        std::vector<std::future<void> > futs;
+        for(int t=0; t<4; ++t) {
+            futs.push_back(std::async(std::launch::async, [&q] {
+                int v;
+                for(int i=0; i<20'000; ++i) {
+                    q.push(int(i));
+                    q.try_pop(v);
+                }
+            }));
+        }
+        for(std::future<void>& fut: futs)
+            fut.get();
+        st = q.stats();
+        assert(st.lock.acquisitions >= 14 + 4 * 40'000);
+        std::cout << "contended " << st.lock.contended << " of " << st.lock.acquisitions
+                  << " acquisitions, waited " << st.lock.wait_ns << " ns\n";
+    }
+
+    /////////////// threadsafe_hashmap /////////////////
+    std::cout << "threadsafe_hashmap stats test" << std::endl;
+    {
+        threadsafe_hashmap<int, int> hashmap(7);
+        // Identity hash: keys 0, 7, 14 land in bucket 0, key 1 in bucket 1
+        hashmap.add_or_update(0, 0);
+        hashmap.add_or_update(7, 7);
+        hashmap.add_or_update(14, 14);
+        hashmap.add_or_update(1, 1);
+        assert(hashmap.get_value(7) == 7);
+
+        hashmap_stats_snapshot st = hashmap.stats();
+        assert(st.bucket_locks.size() == 7);
+        assert(st.max_bucket_length == 3);
+        assert(st.length_histogram.size() == 4);
+        assert(st.length_histogram[0] == 5);
+        assert(st.length_histogram[1] == 1);
+        assert(st.length_histogram[3] == 1);
+        // 3 writes and 1 read on bucket 0, get_size() doesn't count
+        assert(hashmap.get_size() == 4);
+        st = hashmap.stats();
+        assert(st.bucket_locks[0].acquisitions == 4);
+        assert(st.bucket_locks[2].acquisitions == 0);
+    }
+
+    /////////////// lockfree_multimap /////////////////
+    std::cout << "lockfree_multimap stats test" << std::endl;
+    {
+        lockfree_multimap<int, int> multimap;
+        lockfree_multimap<int, int>::garbage_collector gc;
+        multimap.update(1, 1, gc);
+        multimap.update(2, 2, gc);
+        multimap.update(2, 3, gc);
+        assert(multimap.lookup(1, -1) == 1);
+        assert(multimap.erase(2, gc) == 2);
+
+        multimap_stats_snapshot st = multimap.stats();
+        assert(st.update_cas_retries == 0);
+        assert(st.erase_cas_retries == 0);
+        // The first update had no old map to retire
+        assert(st.retired == 3);
+        assert(st.retired_backlog == st.retired - st.reclaimed);
+        assert(st.retired_backlog == gc.size());
+        assert(st.retired_list_high_water >= gc.size());
+        assert(st.hazard_pointers == 1);
+
+        multimap.reclaim_all(gc);
+        assert(gc.empty());
+        st = multimap.stats();
+        assert(st.reclaimed == st.retired);
+        assert(st.retired_backlog == 0);
+    }
+
+    /////////////// thread_pool /////////////////
+    std::cout << "thread_pool stats test" << std::endl;
+    {
+        thread_pool pool(2);
+        for(int i=0; i<1000; ++i)
+            pool.post([]{ std::this_thread::sleep_for(std::chrono::microseconds(1)); });
+        pool.drain();
+
+        thread_pool_stats_snapshot st = pool.stats();
+        assert(st.nodes.size() == pool.num_nodes());
+        std::uint64_t high_water = 0;
+        for(const queue_stats_snapshot& node: st.nodes) {
+            assert(node.depth == 0);
+            high_water = std::max(high_water, node.depth_high_water);
+            assert(node.lock.acquisitions >= 1);
+        }
+        assert(high_water >= 1);
+        assert(st.queue_latency.count == 1000);
+        assert(st.exec_latency.count == 1000);
+        // every task slept for at least a microsecond
+        assert(st.exec_latency.total_ns >= 1000 * 1000);
+        assert(st.exec_latency.percentile_ns(0.5) >= 1000);
+        assert(st.exec_latency.percentile_ns(0.999) <= st.exec_latency.max_ns);
+        std::cout << "queue latency p50 " << st.queue_latency.percentile_ns(0.5)
+                  << " ns, p99 " << st.queue_latency.percentile_ns(0.99) << " ns\n";
+    }
+
+    return 0;
+}
@@ -2,6 +2,30 @@
 #include <mutex>
 #include <iostream>
 #include <numeric>
+#include <cassert>
+#include <atomic>
+#include <fstream>
+#include <filesystem>
+#include <array>
+#include <sched.h>
+
+// CPUs the calling thread may run on
+std::vector<unsigned> current_affinity()
+{
+    std::vector<unsigned> res;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if(sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for(unsigned i=0; i<CPU_SETSIZE; ++i)
+            if(CPU_ISSET(i, &set))
+                res.push_back(i);
+    }
+    return res;
+}
+
+// Destroyed during static destruction, after everything block_pool creates
+// lazily: its workers' exits must still find somewhere to return their blocks
+thread_pool static_pool(2);
 
 int main() 
 {
@@ -40,5 +64,329 @@ int main()
         std::cout << elapsed.count() << " ms passed\n";
     }
 
+    /////////////// More workers than tasks, destructor must not hang /////////////////
+    std::cout << "Idle workers shutdown test" << std::endl;
+    {
+        thread_pool pool(8);
+        auto fut = pool.submit([]{ return 42; });
+        assert(fut.get() == 42);
+    }
+
+    /////////////// drain() and shutdown() /////////////////
+    std::cout << "drain/shutdown test" << std::endl;
+    auto start = std::chrono::high_resolution_clock::now();
+    {
+        thread_pool pool(4);
+        std::atomic<int> counter(0);
+        for(int round=0; round<3; ++round) {
+            for(int i=0; i<10'000; ++i)
+                pool.submit([&counter]{ counter.fetch_add(1); });
+            pool.drain();
+            // all tasks submitted so far are done, workers are still alive
+            assert(counter.load() == 10'000 * (round+1));
+        }
+        // bursty traffic: let the workers park, then submit again
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        for(int i=0; i<1000; ++i)
+            pool.submit([&counter]{ counter.fetch_add(1); });
+        pool.shutdown();
+        // shutdown runs whatever was still queued
+        assert(counter.load() == 31'000);
+        assert(pool.stopped());
+        bool thrown = false;
+        try {
+            pool.submit([]{});
+        }
+        catch(const std::runtime_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+        // shutdown is idempotent, the destructor calls it again
+        pool.shutdown();
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double, std::milli> elapsed = end-start;
+    std::cout << elapsed.count() << " ms passed\n";
+
+    /////////////// post() racing shutdown() /////////////////
+    std::cout << "post/shutdown race test" << std::endl;
+    for(int run=0; run<300; ++run) {
+        thread_pool pool(2);
+        std::atomic<int> ran(0);
+        std::atomic_bool started(false);
+        int accepted = 0;
+        auto poster = std::async(std::launch::async, [&] {
+            while(true) {
+                try {
+                    pool.post([&ran]{ ran.fetch_add(1); });
+                }
+                catch(const std::runtime_error&) {
+                    return;
+                }
+                ++accepted;
+                started = true;
+            }
+        });
+        while(!started)
+            std::this_thread::yield();
+        pool.shutdown();
+        poster.get();
+        // every accepted task ran, and drain() doesn't wait for a lost one
+        pool.drain();
+        assert(ran.load() == accepted);
+    }
+
+    /////////////// NUMA topology discovery from a fake sysfs tree /////////////////
+    std::cout << "numa_topology test" << std::endl;
+    {
+        namespace fs = std::filesystem;
+        fs::path root = fs::temp_directory_path() / "test_thread_pool_sysfs";
+        fs::remove_all(root);
+        fs::create_directories(root / "node0");
+        fs::create_directories(root / "node1");
+        std::ofstream(root / "online") << "0-1\n";
+        std::ofstream(root / "node0" / "cpulist") << "0-3,8-11\n";
+        std::ofstream(root / "node0" / "distance") << "10 21\n";
+        std::ofstream(root / "node1" / "cpulist") << "4-7,12-15\n";
+        std::ofstream(root / "node1" / "distance") << "21 10\n";
+
+        numa_topology topo(root.string(), {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15});
+        assert(topo.num_nodes() == 2);
+        assert(topo.num_cpus() == 16);
+        assert((topo.nodes()[0].cpus == std::vector<unsigned>{0, 1, 2, 3, 8, 9, 10, 11}));
+        assert((topo.nodes()[1].distance == std::vector<unsigned>{21, 10}));
+        assert((topo.nodes_by_distance(1) == std::vector<unsigned>{1, 0}));
+
+        // node1 has no CPU we may run on, so it's dropped
+        numa_topology restricted(root.string(), {0, 1, 2});
+        assert(restricted.num_nodes() == 1);
+        assert(restricted.nodes()[0].id == 0);
+        assert((restricted.nodes()[0].cpus == std::vector<unsigned>{0, 1, 2}));
+
+        // no sysfs NUMA info at all: single node with every allowed CPU
+        numa_topology missing((root / "nonexistent").string(), {0, 1});
+        assert(missing.num_nodes() == 1);
+        assert((missing.nodes()[0].cpus == std::vector<unsigned>{0, 1}));
+        fs::remove_all(root);
+
+        // the real machine always has at least one node
+        numa_topology real;
+        assert(real.num_nodes() >= 1);
+        assert(real.num_cpus() >= 1);
+    }
+
+    /////////////// Pinned and NUMA-aware pools /////////////////
+    std::cout << "Worker placement test" << std::endl;
+    {
+        thread_pool_options opts;
+        opts.pin_workers = true;
+        opts.numa_aware = true;
+        thread_pool pool(4, opts);
+        assert(pool.num_nodes() >= 1);
+        assert(pool.num_nodes() <= numa_topology().num_nodes());
+        std::atomic<int> counter(0);
+        std::vector<std::future<int> > results;
+        for(unsigned i=0; i<1000; ++i)
+            results.push_back(pool.submit([&counter, i]{ counter.fetch_add(1); return int(i); }, i));
+        for(unsigned i=0; i<1000; ++i)
+            assert(results[i].get() == int(i));
+        pool.drain();
+        assert(counter.load() == 1000);
+        assert(pool.worker_node() == -1);
+
+        // every worker is pinned to exactly one CPU of its node, and runs there
+        for(unsigned i=0; i<100; ++i) {
+            pool.submit([&pool]{
+                std::vector<unsigned> cpus = current_affinity();
+                assert(cpus.size() == 1);
+                assert(unsigned(sched_getcpu()) == cpus[0]);
+                int node = pool.worker_node();
+                assert(node >= 0 && unsigned(node) < pool.num_nodes());
+            }, i).get();
+        }
+    }
+    {
+        // pin to an explicit CPU set
+        thread_pool_options opts;
+        opts.cpus = numa_topology().nodes()[0].cpus;
+        thread_pool pool(2, opts);
+        assert(pool.num_nodes() == 1);
+        assert(pool.submit([]{ return 7; }).get() == 7);
+        std::vector<unsigned> cpus = pool.submit([]{ return current_affinity(); }).get();
+        assert(cpus == opts.cpus);
+    }
+    {
+        // Two fake nodes sharing the first CPU we may use, one worker each
+        namespace fs = std::filesystem;
+        unsigned cpu = numa_topology().nodes()[0].cpus[0];
+        fs::path root = fs::temp_directory_path() / "test_thread_pool_sysfs_pool";
+        fs::remove_all(root);
+        fs::create_directories(root / "node0");
+        fs::create_directories(root / "node1");
+        std::ofstream(root / "online") << "0-1\n";
+        std::ofstream(root / "node0" / "cpulist") << cpu << "\n";
+        std::ofstream(root / "node0" / "distance") << "10 21\n";
+        std::ofstream(root / "node1" / "cpulist") << cpu << "\n";
+        std::ofstream(root / "node1" / "distance") << "21 10\n";
+
+        thread_pool_options opts;
+        opts.numa_aware = true;
+        opts.sysfs_root = root.string();
+        thread_pool pool(2, opts);
+        fs::remove_all(root);
+        assert(pool.num_nodes() == 2);
+
+        // Occupy both workers, so that queued tasks stay where they were put
+        std::atomic<int> arrived(0), counter(0);
+        std::atomic_bool go(false), nested_posted(false), release(false);
+        int seen[2] = {-1, -1};
+        for(unsigned n=0; n<2; ++n) {
+            pool.post([&, n]{
+                // not pinned, but kept on the CPUs of its node
+                assert((current_affinity() == std::vector<unsigned>{cpu}));
+                seen[n] = pool.worker_node();
+                arrived.fetch_add(1);
+                while(!go)
+                    std::this_thread::yield();
+                if(pool.worker_node() == 1) {
+                    // no hint from a worker: stays on the worker's node, where
+                    // round-robin would have picked node 0
+                    pool.post([&counter]{ counter.fetch_add(1); });
+                    nested_posted = true;
+                }
+                while(!release)
+                    std::this_thread::yield();
+            }, n);
+        }
+        while(arrived.load() != 2)
+            std::this_thread::yield();
+        // one worker per node, so the two blockers ran on different nodes
+        assert(seen[0] != seen[1] && seen[0] >= 0 && seen[1] >= 0);
+
+        pool.post([&counter]{ counter.fetch_add(1); }, 1);
+        assert(pool.queue_depth(0) == 0 && pool.queue_depth(1) == 1);
+        go = true;
+        while(!nested_posted)
+            std::this_thread::yield();
+        assert(pool.queue_depth(0) == 0 && pool.queue_depth(1) == 2);
+        // no hint from outside the pool: round-robin
+        pool.post([&counter]{ counter.fetch_add(1); });
+        assert(pool.queue_depth(0) == 1 && pool.queue_depth(1) == 2);
+        pool.post([&counter]{ counter.fetch_add(1); });
+        assert(pool.queue_depth(0) == 1 && pool.queue_depth(1) == 3);
+
+        release = true;
+        pool.drain();
+        assert(counter.load() == 4);
+    }
+
+    /////////////// small_task storage /////////////////
+    std::cout << "small_task test" << std::endl;
+    {
+        int calls = 0;
+        small_task small([&calls]{ ++calls; });
+        small();
+        // moved-from tasks are empty
+        small_task moved(std::move(small));
+        assert(!small && moved);
+        moved();
+        assert(calls == 2);
+
+        // too big for the inline buffer, lives in a block_pool block
+        std::array<char, 2 * small_task::INLINE_SIZE> big{};
+        big[0] = 'x';
+        small_task large([big, &calls]{ calls += big[0] == 'x'; });
+        small_task assigned;
+        assigned = std::move(large);
+        assigned();
+        assert(calls == 3);
+
+        // move-only state is fine too
+        auto ptr = std::make_unique<int>(5);
+        small_task owning([p = std::move(ptr), &calls]{ calls += *p; });
+        owning();
+        assert(calls == 8);
+    }
+
+    /////////////// post() and exceptions through submit() /////////////////
+    std::cout << "post/exception test" << std::endl;
+    {
+        thread_pool pool(4);
+        std::atomic<int> counter(0);
+        for(int i=0; i<10'000; ++i)
+            pool.post([&counter]{ counter.fetch_add(1); });
+        pool.drain();
+        assert(counter.load() == 10'000);
+
+        auto fut = pool.submit([]() -> int { throw std::logic_error("task failed"); });
+        bool thrown = false;
+        try {
+            fut.get();
+        }
+        catch(const std::logic_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+
+        auto void_fut = pool.submit([&counter]{ counter.fetch_add(1); });
+        void_fut.get();
+        assert(counter.load() == 10'001);
+    }
+
+    /////////////// Pool with static storage /////////////////
+    std::cout << "Static pool test" << std::endl;
+    {
+        // Too big for small_task's inline buffer, so the callables and the
+        // shared states both come from block_pool and end up in worker caches
+        std::vector<std::future<int> > futs;
+        for(int i=0; i<1000; ++i)
+            futs.push_back(static_pool.submit([i, pad = std::array<char, 100>{}] { return i + pad[0]; }));
+        int sum = 0;
+        for(std::future<int>& fut: futs)
+            sum += fut.get();
+        assert(sum == 999 * 1000 / 2);
+    }
+
+    /////////////// Submission overhead /////////////////
+    std::cout << "Submission overhead test" << std::endl;
+    {
+        // Submission cost on the caller's side: tasks go in batches and only
+        // the submitting loops are timed, the workers catch up in between
+        constexpr int batch = 1000;
+        constexpr int num_batches = 1000;
+        constexpr int num_tasks = batch * num_batches;
+        thread_pool pool(1);
+        std::atomic<int> counter(0);
+        // warm up the ring buffer and the block caches
+        for(int i=0; i<num_tasks; ++i)
+            pool.post([&counter]{ counter.fetch_add(1, std::memory_order_relaxed); });
+        pool.drain();
+
+        std::chrono::duration<double, std::nano> elapsed(0);
+        for(int b=0; b<num_batches; ++b) {
+            auto start = std::chrono::high_resolution_clock::now();
+            for(int i=0; i<batch; ++i)
+                pool.post([&counter]{ counter.fetch_add(1, std::memory_order_relaxed); });
+            elapsed += std::chrono::high_resolution_clock::now() - start;
+            pool.drain();
+        }
+        std::cout << "post: " << elapsed.count() / num_tasks << " ns per task\n";
+
+        std::vector<std::future<void> > futs;
+        futs.reserve(batch);
+        elapsed = elapsed.zero();
+        for(int b=0; b<num_batches; ++b) {
+            auto start = std::chrono::high_resolution_clock::now();
+            for(int i=0; i<batch; ++i)
+                futs.push_back(pool.submit([&counter]{ counter.fetch_add(1, std::memory_order_relaxed); }));
+            elapsed += std::chrono::high_resolution_clock::now() - start;
+            for(std::future<void>& fut: futs)
+                fut.get();
+            futs.clear();
+        }
+        std::cout << "submit: " << elapsed.count() / num_tasks << " ns per task\n";
+        assert(counter.load() == 3 * num_tasks);
+    }
+
     return 0;
 }
\ No newline at end of file
@@ -1,61 +1,455 @@
-#include "threadsafe_queue.hpp"
+#include "numa_topology.hpp"
+#include "small_task.hpp"
+#include "container_stats.hpp"
 #include <functional>
 #include <future>
+#include <mutex>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <stdexcept>
 
-class thread_pool 
+struct thread_pool_options
 {
-    threadsafe_queue<std::move_only_function<void()> > work_q;
+    // Pin every worker to a single CPU, handed out round-robin
+    bool pin_workers = false;
+    // Group workers per NUMA node, each node with its own queue, and keep
+    // every worker on the CPUs of its node
+    bool numa_aware = false;
+    // CPUs the workers may run on, empty means every CPU the process may use
+    std::vector<unsigned> cpus;
+    // Where to read the NUMA topology from, empty means /sys/devices/system/node
+    std::string sysfs_root;
+};
+
+struct thread_pool_stats_snapshot
+{
+    // One entry per node queue, lock and depth figures zeroed unless CONCURRENCY_STATS is set
+    std::vector<queue_stats_snapshot> nodes;
+    // From post()/submit() to the start of the task's execution
+    latency_snapshot queue_latency;
+    // Running time of the tasks
+    latency_snapshot exec_latency;
+};
+
+class thread_pool
+{
+    // Idle strategy: a worker that finds the queues empty first spins for
+    // SPIN_ITERATIONS, then yields for YIELD_ITERATIONS, and only then parks
+    static constexpr unsigned SPIN_ITERATIONS = 2000;
+    static constexpr unsigned YIELD_ITERATIONS = 50;
+    static constexpr std::size_t CACHE_LINE = 64;
+
+    // Work queue of one node, with the workers placed on it parking on wake_seq.
+    // Tasks sit in a power-of-two ring buffer that only ever grows, so a
+    // push doesn't allocate once the queue has seen its peak depth.
+    struct queued_task {
+        small_task task;
+        [[no_unique_address]] stats_timestamp enqueued;
+    };
+
+    struct node_queue {
+        std::mutex mut;
+        std::vector<queued_task> ring;
+        std::size_t head = 0;   // index of the oldest task
+        std::size_t count = 0;
+        // Set by shutdown() under mut, so that no push can slip in after the
+        // workers have seen the pool stopping
+        bool closed = false;
+        // Wake-up state, on its own cache line so that submitters and idle
+        // workers polling it don't fight over the line holding mut.
+        // Bumped on every push meant for this node and on shutdown
+        alignas(CACHE_LINE) std::atomic<unsigned> wake_seq{0};
+        // Number of this node's workers in idle_wait(), spinning or parked
+        std::atomic<unsigned> idle{0};
+        // Number of this node's workers currently parked on wake_seq
+        std::atomic<unsigned> sleepers{0};
+        // Node indices to take work from, own node first, then by distance
+        alignas(CACHE_LINE) std::vector<unsigned> steal_order;
+        [[no_unique_address]] lock_stats lock_st;
+        [[no_unique_address]] high_water_mark depth_hw;
+
+        // Returns false, leaving task untouched, once the queue is closed
+        bool push(small_task&& task) {
+            std::unique_lock<std::mutex> lk(mut, std::defer_lock);
+            lock_st.lock(lk);
+            if(closed)
+                return false;
+            if(count == ring.size()) {
+                std::vector<queued_task> bigger(ring.empty() ? 64 : 2 * ring.size());
+                for(std::size_t i=0; i<count; ++i)
+                    bigger[i] = std::move(ring[(head + i) & (ring.size() - 1)]);
+                ring.swap(bigger);
+                head = 0;
+            }
+            queued_task& slot = ring[(head + count) & (ring.size() - 1)];
+            slot.task = std::move(task);
+            slot.enqueued = stats_timestamp::now();
+            ++count;
+            depth_hw.update(count);
+            return true;
+        }
+
+        void close() {
+            std::lock_guard<std::mutex> lk(mut);
+            closed = true;
+        }
+
+        bool try_pop(queued_task& task) {
+            std::unique_lock<std::mutex> lk(mut, std::defer_lock);
+            lock_st.lock(lk);
+            if(count == 0)
+                return false;
+            task = std::move(ring[head]);
+            head = (head + 1) & (ring.size() - 1);
+            --count;
+            return true;
+        }
+
+        std::size_t size() {
+            std::lock_guard<std::mutex> lk(mut);
+            return count;
+        }
+    };
+
+    std::vector<std::unique_ptr<node_queue> > nodes;
     std::vector<std::future<void> > futures;
 
-    void worker_thread() 
+    // Tasks submitted but not yet finished, drain() waits on it
+    std::atomic<unsigned> unfinished;
+    // Spreads submissions without a node hint over the nodes
+    std::atomic<unsigned> next_node;
+    std::atomic_bool done;
+
+    enum { QUEUE_LATENCY, EXEC_LATENCY, NUM_LATENCIES };
+    [[no_unique_address]] latency_histograms<NUM_LATENCIES> latencies;
+
+    // Lets submit() route work from a worker to its own node
+    static inline thread_local const thread_pool* current_pool = nullptr;
+    static inline thread_local unsigned current_node = 0;
+
+    static void cpu_relax() noexcept {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        asm volatile("yield");
+#endif
+    }
+
+    // Wakes a worker of node idx. Other nodes are only disturbed, nearest
+    // first, when every worker of node idx is busy running a task.
+    void wake_one(unsigned idx) {
+        for(unsigned n: nodes[idx]->steal_order) {
+            node_queue& nq = *nodes[n];
+            nq.wake_seq.fetch_add(1);
+            // A worker about to park re-checks wake_seq, so skip the syscall when nobody sleeps
+            if(nq.sleepers.load() != 0)
+                nq.wake_seq.notify_one();
+            // A worker entering idle_wait() after the load below still sees
+            // the bumped wake_seq and rescans
+            if(nq.idle.load() != 0)
+                return;
+        }
+    }
+
+    void wake_all() {
+        for(std::unique_ptr<node_queue>& nq: nodes) {
+            nq->wake_seq.fetch_add(1);
+            nq->wake_seq.notify_all();
+        }
+    }
+
+    // Spin, then yield, then park until wake_seq moves away from seq
+    void idle_wait(node_queue& nq, unsigned seq) {
+        nq.idle.fetch_add(1);
+        do_idle_wait(nq, seq);
+        nq.idle.fetch_sub(1);
+    }
+
+    void do_idle_wait(node_queue& nq, unsigned seq) {
+        for(unsigned i=0; i<SPIN_ITERATIONS; ++i) {
+            if(nq.wake_seq.load(std::memory_order_relaxed) != seq)
+                return;
+            cpu_relax();
+        }
+        for(unsigned i=0; i<YIELD_ITERATIONS; ++i) {
+            if(nq.wake_seq.load(std::memory_order_relaxed) != seq)
+                return;
+            std::this_thread::yield();
+        }
+        nq.sleepers.fetch_add(1);
+        nq.wake_seq.wait(seq);
+        nq.sleepers.fetch_sub(1);
+    }
+
+    bool try_pop(const node_queue& own, queued_task& task) {
+        for(unsigned n: own.steal_order)
+            if(nodes[n]->try_pop(task))
+                return true;
+        return false;
+    }
+
+    void worker_thread(unsigned node_idx, std::vector<unsigned> cpus)
     {
-        do{
-            std::move_only_function<void()> task;
-            work_q.wait_and_pop(task);
-            task();
-        } while(!work_q.empty());
+        if(!cpus.empty())
+            numa_topology::pin_current_thread(cpus);
+        current_pool = this;
+        current_node = node_idx;
+
+        node_queue& own = *nodes[node_idx];
+        queued_task queued;
+        while(true) {
+            // Read the sequence before looking at the queues, so that a push
+            // landing after a failed try_pop always changes it
+            unsigned seq = own.wake_seq.load();
+            // done is only set once every queue is closed, so if it was
+            // already set before this scan, nothing can be pushed behind it
+            bool stopping = done.load();
+            if(try_pop(own, queued)) {
+                stats_timestamp started = stats_timestamp::now();
+                latencies.record(QUEUE_LATENCY, queued.enqueued, started);
+                queued.task();
+                queued.task = small_task();
+                latencies.record(EXEC_LATENCY, started, stats_timestamp::now());
+                if(unfinished.fetch_sub(1) == 1)
+                    unfinished.notify_all();
+                continue;
+            }
+            // Only leave once the queues have been emptied
+            if(stopping)
+                break;
+            idle_wait(own, seq);
+        }
+        current_pool = nullptr;
+    }
+
+    unsigned default_node() {
+        return (current_pool == this) ? current_node : next_node.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void enqueue(small_task&& task, unsigned node_hint) {
+        unsigned idx = node_hint % nodes.size();
+        unfinished.fetch_add(1);
+        try {
+            // A closed queue means shutdown() has started
+            if(!nodes[idx]->push(std::move(task)))
+                throw std::runtime_error("thread_pool: submit after shutdown");
+        }
+        catch(...) {
+            if(unfinished.fetch_sub(1) == 1)
+                unfinished.notify_all();
+            throw;
+        }
+        wake_one(idx);
+    }
+
+    // CPUs of one node of the pool and the node indices its workers take work from
+    struct node_plan {
+        std::vector<unsigned> cpus;
+        std::vector<unsigned> steal_order;
+    };
+
+    // Splits the allowed CPUs into the nodes the workers will be placed on.
+    // Empty when no placement was asked for.
+    static std::vector<node_plan> plan_nodes(unsigned available_threads, const thread_pool_options& opts) {
+        std::vector<node_plan> res;
+        if(!opts.pin_workers && !opts.numa_aware && opts.cpus.empty())
+            return res;
+
+        numa_topology topo = opts.sysfs_root.empty() ? numa_topology() : numa_topology(opts.sysfs_root);
+        std::vector<unsigned> topo_idx;
+        for(unsigned i=0; i<topo.num_nodes(); ++i) {
+            std::vector<unsigned> cpus;
+            for(unsigned cpu: topo.nodes()[i].cpus)
+                if(opts.cpus.empty() || std::find(opts.cpus.begin(), opts.cpus.end(), cpu) != opts.cpus.end())
+                    cpus.push_back(cpu);
+            if(cpus.empty())
+                continue;
+            if(opts.numa_aware) {
+                res.push_back(node_plan{std::move(cpus), {}});
+                topo_idx.push_back(i);
+            }
+            else {
+                if(res.empty())
+                    res.emplace_back();
+                res[0].cpus.insert(res[0].cpus.end(), cpus.begin(), cpus.end());
+            }
+        }
+        // Requested CPUs that the topology doesn't know about: use them as they are
+        if(res.empty() && !opts.cpus.empty())
+            res.push_back(node_plan{opts.cpus, {}});
+        // No point in nodes without workers
+        if(res.size() > std::max(1u, available_threads))
+            res.resize(std::max(1u, available_threads));
+
+        for(unsigned i=0; i<res.size(); ++i) {
+            if(topo_idx.size() < res.size()) {
+                res[i].steal_order.push_back(i);
+                continue;
+            }
+            // Own node first, then the others by distance
+            for(unsigned t: topo.nodes_by_distance(topo_idx[i])) {
+                auto found = std::find(topo_idx.begin(), topo_idx.begin() + res.size(), t);
+                if(found != topo_idx.begin() + res.size())
+                    res[i].steal_order.push_back(found - topo_idx.begin());
+            }
+        }
+        return res;
     }
 
 public:
-    thread_pool(unsigned available_threads): 
-        work_q(), futures()
+    thread_pool(unsigned available_threads, const thread_pool_options& opts = thread_pool_options()):
+        nodes(), futures(), unfinished(0), next_node(0), done(false)
     {
+        std::vector<node_plan> placement = plan_nodes(available_threads, opts);
+        unsigned num_nodes = std::max<std::size_t>(1, placement.size());
+
+        for(unsigned i=0; i<num_nodes; ++i) {
+            nodes.emplace_back(new node_queue);
+            if(placement.empty())
+                nodes[i]->steal_order.push_back(i);
+            else
+                nodes[i]->steal_order = placement[i].steal_order;
+        }
+
         futures.reserve(available_threads);
         try {
             for(unsigned i=0; i<available_threads; ++i) {
-                futures.push_back( 
-                    std::async(std::launch::async, &thread_pool::worker_thread, this));
+                unsigned node_idx = i % num_nodes;
+                std::vector<unsigned> cpus;
+                if(!placement.empty()) {
+                    const std::vector<unsigned>& node_set = placement[node_idx].cpus;
+                    if(opts.pin_workers)
+                        cpus.push_back(node_set[(i / num_nodes) % node_set.size()]);
+                    else
+                        cpus = node_set;
+                }
+                futures.push_back(
+                    std::async(std::launch::async, &thread_pool::worker_thread, this, node_idx, std::move(cpus)));
             }
         }
         catch(...) {
-            // wait for the thread pool to be done
-            for(std::future<void>& fut: futures) {
-                fut.get();
-            }
+            shutdown();
             throw;
         }
     }
 
     ~thread_pool() {
+        shutdown();
+    }
+
+    thread_pool(const thread_pool& other) = delete;
+    thread_pool& operator=(const thread_pool& rhs) = delete;
+
+    // Number of node queues, valid node hints for submit() are [0, num_nodes())
+    unsigned num_nodes() const noexcept {
+        return nodes.size();
+    }
+
+    // Node of the calling thread if it is one of this pool's workers, -1 otherwise
+    int worker_node() const noexcept {
+        return (current_pool == this) ? int(current_node) : -1;
+    }
+
+    // Tasks waiting in node's queue
+    std::size_t queue_depth(unsigned node) const {
+        return nodes[node]->size();
+    }
+
+    // Per-node queue figures and task latencies, see container_stats.hpp
+    thread_pool_stats_snapshot stats() const {
+        thread_pool_stats_snapshot res;
+        for(const std::unique_ptr<node_queue>& nq: nodes) {
+            queue_stats_snapshot q;
+            q.lock = nq->lock_st.snapshot();
+            q.depth = nq->size();
+            q.depth_high_water = nq->depth_hw.load();
+            res.nodes.push_back(q);
+        }
+        res.queue_latency = latencies.snapshot(QUEUE_LATENCY);
+        res.exec_latency = latencies.snapshot(EXEC_LATENCY);
+        return res;
+    }
+
+    // Blocks until every task submitted so far has finished running.
+    // Workers stay alive and keep accepting new tasks.
+    void drain() {
+        unsigned pending = unfinished.load();
+        while(pending != 0) {
+            unfinished.wait(pending);
+            pending = unfinished.load();
+        }
+    }
+
+    // Stops accepting tasks, lets the workers run whatever is still queued,
+    // wakes all parked workers and waits for them to exit. Idempotent.
+    void shutdown() {
+        for(std::unique_ptr<node_queue>& nq: nodes)
+            nq->close();
+        done.store(true);
+        wake_all();
         // wait for the thread pool to be done
         for(std::future<void>& fut: futures) {
-            fut.get();
+            if(fut.valid())
+                fut.get();
         }
     }
 
+    bool stopped() const noexcept {
+        return done.load();
+    }
+
     /*std::vector<std::future<void> >&& get_futures() {
         return std::move(futures);
     }*/
 
+    // Queues f on node_hint's queue; its workers pick it up first, other
+    // nodes only when they run out of their own work.
+    // Costs roughly twice as much as post(): std::promise takes two block_pool
+    // blocks (shared state and result) and a few atomic operations on top.
     template<typename FuncType>
-    auto submit(FuncType f) {
-        using result_of_f = std::result_of<FuncType()>::type;
+    auto submit(FuncType f, unsigned node_hint) {
+        using result_of_f = std::invoke_result_t<FuncType&>;
 
-        std::packaged_task<result_of_f()> task(std::move(f));
-        std::future<result_of_f> fut = task.get_future();
+        // The shared state comes from block_pool instead of the heap
+        std::promise<result_of_f> prom(std::allocator_arg, block_allocator<result_of_f>());
+        std::future<result_of_f> fut = prom.get_future();
 
-        work_q.push(std::move(task));
+        enqueue(small_task([f = std::move(f), prom = std::move(prom)]() mutable {
+            try {
+                if constexpr(std::is_void_v<result_of_f>) {
+                    f();
+                    prom.set_value();
+                }
+                else
+                    prom.set_value(f());
+            }
+            catch(...) {
+                prom.set_exception(std::current_exception());
+            }
+        }), node_hint);
 
         return fut;
     }
-};
\ No newline at end of file
+
+    // Without a hint, work submitted from a worker stays on its node and
+    // work from outside the pool is spread round-robin
+    template<typename FuncType>
+    auto submit(FuncType f) {
+        return submit(std::move(f), default_node());
+    }
+
+    // Fire-and-forget: no future, no shared state. f must not throw, an
+    // escaping exception calls std::terminate.
+    template<typename FuncType>
+    void post(FuncType f, unsigned node_hint) {
+        enqueue(small_task([f = std::move(f)]() mutable noexcept {
+            f();
+        }), node_hint);
+    }
+
+    template<typename FuncType>
+    void post(FuncType f) {
+        post(std::move(f), default_node());
+    }
+};
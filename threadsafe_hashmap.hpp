@@ -1,3 +1,4 @@
+#include "container_stats.hpp"
 #include <functional>
 #include <vector>
 #include <utility>
@@ -11,6 +12,14 @@
 
 constexpr unsigned DEFAULT_NUM_BUCKETS = 19;
 
+struct hashmap_stats_snapshot {
+    // Per-bucket lock contention, zeroed unless CONCURRENCY_STATS is set
+    std::vector<lock_stats_snapshot> bucket_locks;
+    // length_histogram[n] is the number of buckets holding n entries
+    std::vector<std::uint64_t> length_histogram;
+    std::size_t max_bucket_length = 0;
+};
+
 template<typename Key, typename Value, typename Hash=std::hash<Key> >
 class threadsafe_hashmap {
 private: 
@@ -23,11 +32,13 @@ private:
 
         bucket_data data;
         mutable std::shared_timed_mutex mutex;
+        [[no_unique_address]] mutable lock_stats lock_st;
 
     public:
         Value get_value(const Key& key, const Value& default_value) const {
             // Use shared lock to allow multiple readers
-            std::shared_lock<std::shared_timed_mutex> lock(mutex);
+            std::shared_lock<std::shared_timed_mutex> lock(mutex, std::defer_lock);
+            lock_st.lock(lock);
             const_iterator found_entry = std::find_if(std::begin(data), std::end(data), [&](const bucket_value& item) {
                 return (key == item.first);
             });
@@ -36,7 +47,8 @@ private:
 
         void add_or_update(const Key& key, const Value& value) {
             // Use unique lock for exclusive writing
-            std::unique_lock<std::shared_timed_mutex> lock(mutex);
+            std::unique_lock<std::shared_timed_mutex> lock(mutex, std::defer_lock);
+            lock_st.lock(lock);
             auto found_entry = std::find_if(std::begin(data), std::end(data), [&](const bucket_value& item) {
                 return (key == item.first);
             });
@@ -50,7 +62,8 @@ private:
 
         void remove(const Key& key) {
             // Use unique lock for exclusive writing
-            std::unique_lock<std::shared_timed_mutex> lock(mutex);
+            std::unique_lock<std::shared_timed_mutex> lock(mutex, std::defer_lock);
+            lock_st.lock(lock);
             auto found_entry = std::find_if(std::begin(data), std::end(data), [&](const bucket_value& item) {
                 return (key == item.first);
             });
@@ -58,11 +71,16 @@ private:
                 data.erase(found_entry);
         }
 
+        // Not counted in the lock stats, so that stats() doesn't skew them
         int get_size() const noexcept {
             // Use shared lock to allow multiple readers
             std::shared_lock<std::shared_timed_mutex> lock(mutex);
             return data.size();
         }
+
+        lock_stats_snapshot get_lock_stats() const noexcept {
+            return lock_st.snapshot();
+        }
     };
 
     std::vector<std::unique_ptr<bucket>> _buckets;
@@ -108,4 +126,20 @@ public:
         }
         return bkt_sz;
     }
+
+    // Bucket length histogram, plus per-bucket lock contention when
+    // CONCURRENCY_STATS is set
+    hashmap_stats_snapshot stats() const {
+        hashmap_stats_snapshot res;
+        res.bucket_locks.reserve(_buckets.size());
+        for(const std::unique_ptr<bucket>& bkt: _buckets) {
+            res.bucket_locks.push_back(bkt->get_lock_stats());
+            std::size_t len = bkt->get_size();
+            if(len >= res.length_histogram.size())
+                res.length_histogram.resize(len + 1);
+            ++res.length_histogram[len];
+            res.max_bucket_length = std::max(res.max_bucket_length, len);
+        }
+        return res;
+    }
 };
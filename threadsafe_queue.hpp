@@ -1,5 +1,7 @@
+#include "container_stats.hpp"
 #include <queue>
 #include <memory>
+#include <mutex>
 #include <condition_variable>
 
 template<typename T>
@@ -9,12 +11,15 @@ private:
     mutable std::mutex mut;
     std::queue<std::shared_ptr<T> > data_q;
     std::condition_variable cond_var;
+    [[no_unique_address]] mutable lock_stats lock_st;
+    [[no_unique_address]] high_water_mark depth_hw;
 
 public:
     threadsafe_queue() {}
 
     void wait_and_pop(T& value) {
-        std::unique_lock<std::mutex> lk(mut);
+        std::unique_lock<std::mutex> lk(mut, std::defer_lock);
+        lock_st.lock(lk);
         cond_var.wait(lk, [this] {
             return !data_q.empty();
         });
@@ -23,16 +28,18 @@ public:
     }
 
     bool try_pop(T& value) {
+        std::unique_lock<std::mutex> lk(mut, std::defer_lock);
+        lock_st.lock(lk);
         if(data_q.empty())
             return false;
-        std::lock_guard<std::mutex> lk(mut);
         value = std::move(*data_q.front());
         data_q.pop();
         return true;
     }
 
     std::shared_ptr<T> wait_and_pop() {
-        std::unique_lock<std::mutex> lk(mut);
+        std::unique_lock<std::mutex> lk(mut, std::defer_lock);
+        lock_st.lock(lk);
         cond_var.wait(lk, [this] {
             return !data_q.empty();
         });
@@ -42,9 +49,10 @@ public:
     }
 
     std::shared_ptr<T> try_pop() {
+        std::unique_lock<std::mutex> lk(mut, std::defer_lock);
+        lock_st.lock(lk);
         if(data_q.empty())
             return std::shared_ptr<T>();
-        std::lock_guard<std::mutex> lk(mut);
         std::shared_ptr<T> res = data_q.front();
         data_q.pop();
         return res;
@@ -54,11 +62,14 @@ public:
         std::shared_ptr<T> data(
             std::make_shared<T>(std::move(new_value))
         );
-        std::lock_guard<std::mutex> lk(mut);
+        std::unique_lock<std::mutex> lk(mut, std::defer_lock);
+        lock_st.lock(lk);
         data_q.push(data);
+        depth_hw.update(data_q.size());
         cond_var.notify_one();
     }
 
+    // Polls and stats() scrapes don't count towards the lock stats
     bool empty() const {
         std::lock_guard<std::mutex> lk(mut);
         return data_q.empty();
@@ -68,4 +79,13 @@ public:
         std::lock_guard<std::mutex> lk(mut);
         return data_q.size();
     }
+
+    // Lock contention and depth high-water mark, zeroed unless CONCURRENCY_STATS is set
+    queue_stats_snapshot stats() const {
+        queue_stats_snapshot res;
+        res.lock = lock_st.snapshot();
+        res.depth = size();
+        res.depth_high_water = depth_hw.load();
+        return res;
+    }
 };
\ No newline at end of file